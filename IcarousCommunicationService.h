@@ -41,29 +41,84 @@
 #include "afrl/cmasi/MissionCommand.h"
 #include "afrl/cmasi/KeepInZone.h"
 #include "afrl/cmasi/KeepOutZone.h"
+#include "afrl/cmasi/RemoveZones.h"
+#include "afrl/cmasi/KeyValuePair.h"
 #include "afrl/cmasi/AirVehicleState.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <stdio.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <memory>
+#include <unordered_map>
+#include <map>
+#include <list>
+#include <queue>
+#include <algorithm>
+#include <limits>
 #include <errno.h>
 #include <cmath>
 #include <math.h>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
+#include <atomic>
+#include <array>
 #include <semaphore.h>
 
 #define PORT 5557
 #define STRING_XML_ICAROUS_CONNECTIONS "NumberOfUAVs"
+#define STRING_XML_MONITORED_UAVS "NumberOfMonitoredUAVs"
+#define STRING_XML_TICK_QUORUM "TickQuorum"
+#define STRING_XML_PROJECTION_HORIZON "ProjectionHorizon"
+#define STRING_XML_TRACE_LEVEL "TraceLevel"
+#define STRING_XML_FLIGHT_PLAN_CAPACITY "FlightPlanCapacity"
+#define STRING_XML_ROUTE_PLAN_CAPACITY "RoutePlanCapacity"
+#define STRING_XML_ASSIGNMENT_TRIALS "AssignmentTrials"
+#define STRING_XML_CONSTRAINT_FILE "ConstraintFile"
+#define STRING_XML_CONSTRAINT_RELOAD_PERIOD "ConstraintReloadPeriod"
+#define STRING_KEY_CONSTRAINTS "IcarousConstraints"
+#define STRING_KEY_TASK "IcarousTask"
+#define STRING_KEY_TASK_CANCEL "IcarousTaskCancel"
+#define STRING_KEY_TASK_STATUS "IcarousTaskStatus"
 #define STRING_XML_ICAROUS_ROUTEPLANNER "RoutePlannerUsed"
 #define STRING_XML_LINE_VOLUME "DeviationAllowed"
 #define STRING_XML_ICAROUS_DEVIATION_ORIGIN "DeviationOrigin"
+#define STRING_XML_OUTBOUND_QUEUE_CAPACITY "OutboundQueueCapacity"
+#define STRING_XML_OUTBOUND_OVERFLOW_POLICY "OutboundOverflowPolicy"
+#define STRING_XML_ICAROUS_HOST "IcarousHost"
+#define STRING_XML_RECONNECT_BACKOFF_MIN "ReconnectBackoffMin"
+#define STRING_XML_RECONNECT_BACKOFF_MAX "ReconnectBackoffMax"
+#define STRING_XML_HEARTBEAT_PERIOD "HeartbeatPeriod"
+#define STRING_XML_LIVENESS_TIMEOUT "LivenessTimeout"
+#define STRING_XML_ORIGIN_LATITUDE "OriginLatitude"
+#define STRING_XML_ORIGIN_LONGITUDE "OriginLongitude"
+#define STRING_XML_SPATIAL_CELL_SIZE "SpatialCellSize"
+#define STRING_XML_SEPARATION_DISTANCE "SeparationDistance"
+#define STRING_XML_SEPARATION_HORIZON "SeparationHorizon"
+#define STRING_XML_SEPARATION_ADJUST "SeparationAdjust"
+#define STRING_XML_FORMATION_CONTROLLER "FormationController"
+#define STRING_XML_PREDICTIVE_STEP_TIME "PredictiveStepTime"
+#define STRING_XML_CONTROLLER_BUDGET "ControllerBudget"
+#define STRING_XML_CONTROL_TIME_LAG "ControlTimeLag"
+#define STRING_XML_PLANNER_TIMEOUT "PlannerTimeout"
+#define STRING_XML_SERVICE_PERIOD "ServicePeriod"
+#define STRING_XML_ROUTE_CACHE_SIZE "RouteCacheSize"
+#define STRING_XML_ROUTE_CACHE_RESOLUTION "RouteCacheResolution"
+#define STRING_XML_PLAN_COSTS_LOCALLY "PlanCostsLocally"
+#define STRING_XML_RACE_PLANNERS "RacePlanners"
+#define STRING_XML_RACE_DEADLINE "RaceDeadline"
+#define STRING_XML_WAYPOINT_WINDOW "WaypointWindow"
+#define STRING_XML_HANDOFF_RESUME_FRACTION "HandoffResumeFraction"
+#define STRING_XML_HANDOFF_DWELL "HandoffDwell"
 #define M_PI 3.14159265358979323846
 
 namespace uxas
@@ -79,9 +134,36 @@ namespace service
  * Configuration String: <Service Type="IcarousCommunicationService" NumberOfUAVs="n" />
  * 
  * Options:
- *  - NumberOfUAVs - Used to specify the number of UAVs in a scenario
+ *  - NumberOfUAVs - Used to specify the number of UAVs in a scenario, each with its own ICAROUS (default 3)
+ *  - NumberOfMonitoredUAVs - Number of further UAVs that are tracked but not controlled (default 1)
+ *  - TickQuorum - Number of UAVs that must report a new state before a control tick runs;
+ *                      0 waits for all of them (default 0)
+ *  - ProjectionHorizon - Most seconds a tick projects vehicles ahead, however long since the last tick (default 5)
+ *  - TraceLevel - How much is logged while running
+ *                      0 - connections, configuration problems and the shutdown summary only
+ *                      1 - also hand-offs, conflicts, planner races and other events (default)
+ *                      2 - also every line exchanged with ICAROUS
+ *  - FlightPlanCapacity - MissionCommand waypoints per UAV allocated up front (default 256)
+ *  - RoutePlanCapacity - RoutePlanRequests in flight allocated up front (default 64)
+ *  - AssignmentTrials - Number of randomized task assignment trials to run and report at start
+ *                      for evaluating the constraint graph; 0 skips them (default 0)
+ *  - ConstraintFile - Rules and constraints to load, reloaded whenever the file changes (default none).
+ *                      The same text can be sent as a KeyValuePair with Key "IcarousConstraints".
+ *                      One entry per line, '#' starts a comment:
+ *                      rule <type> <ID>... -> <type> <ID>...   (types: centroid, monitor, global, relative)
+ *                      centroid <longitude> <latitude> <ID>...
+ *                      monitor <ID> <targetID>[:<distance>]...
+ *                      relative <ID> <ID>
+ *                      Rules, if any, replace the rule library; constraints, if any, replace the constraints.
+ *                      A set that fails checkCompatibility is rejected and the current one kept.
+ *  - ConstraintReloadPeriod - Milliseconds between checks of ConstraintFile for changes (default 1000)
+ * 
+ * Tasks can also be assigned one at a time while running: a KeyValuePair with Key "IcarousTask" and a
+ * centroid or monitor line as above for Value is admitted if it is compatible with the active tasks,
+ * and "IcarousTaskCancel" with the same Value withdraws it. Each is answered with an "IcarousTaskStatus"
+ * KeyValuePair whose Value starts with admitted, rejected or cancelled.
  *  - RoutePlannerUsed="n" - Inform this service what planner to use
- *                      -1 - UxAS Visibility planner
+ *                      -1 - Visibility planner around the keep-in/keep-out zones, run within this service
  *                      0 - GRID
  *                      1 - ASTAR
  *                      2 - RRT
@@ -89,15 +171,62 @@ namespace service
  *  - DeviationOrigin - origin point for deviations
  *                      line - the line that is being searched
  *                      path - the path the UAV is taking
+ *  - OutboundQueueCapacity - Number of messages that can wait to be written to each ICAROUS (default 64)
+ *  - OutboundOverflowPolicy - What to do when an ICAROUS outbound queue is full
+ *                      DropOldest - discard the oldest queued message (default)
+ *                      CoalesceLatest - keep only the newest command until the writer catches up
+ *                      Block - wait for the writer to make room, refusing the message while the link is down
+ *  - IcarousHost - IPv4 address of the ICAROUS instances; instance n listens on port 5557 + n - 1 (default 127.0.0.1)
+ *  - ReconnectBackoffMin, ReconnectBackoffMax - Bounds in ms of the exponential reconnect backoff (default 100, 10000)
+ *  - HeartbeatPeriod - ms between heartbeats sent to each ICAROUS (default 1000)
+ *  - LivenessTimeout - ms without hearing from an ICAROUS before its link is dropped (default 5000)
+ *  - OriginLatitude, OriginLongitude - Origin in degrees of the local East-North-Up frame used for
+ *                      control geometry (default: first reported vehicle position)
+ *  - SpatialCellSize - Edge length in metres of the grid cells used for proximity queries (default 500)
+ *  - SeparationDistance - Minimum horizontal separation in metres between vehicles; 0 disables the
+ *                      conflict check (default 0)
+ *  - SeparationHorizon - Seconds ahead that projected trajectories are checked for conflicts (default 10)
+ *  - SeparationAdjust - true to move conflicting loiter points apart, false to only report them (default true)
+ *  - FormationController - How idle vehicles are steered onto their centroid and relative constraints
+ *                      Reactive - loiter at the one-step projection corrected by the constraint error (default)
+ *                      Predictive - receding-horizon plan of waypoints limited by each vehicle's nominal speed
+ *  - PredictiveStepTime - Seconds between the waypoints of a predictive plan (default 1)
+ *  - ControllerBudget - Milliseconds per tick the predictive controller may spend optimizing (default 1)
+ *  - ControlTimeLag - Milliseconds behind the newest vehicle state that each tick is computed for;
+ *                      a lag lets more vehicles be interpolated instead of extrapolated (default 0)
+ *  - ServicePeriod - Milliseconds between checks for planner timeouts and race deadlines while no
+ *                      message arrives; ICAROUS replies are handled as soon as they come (default 50)
+ *  - PlannerTimeout - Milliseconds to wait for ICAROUS to plan one leg of a RoutePlanRequest before
+ *                      reporting that leg as infeasible (default 5000)
+ *  - RouteCacheSize - Number of planned legs remembered so repeated requests skip ICAROUS; 0 disables (default 1024)
+ *  - RouteCacheResolution - Metres to which leg endpoints are rounded when matching cached legs (default 10)
+ *  - PlanCostsLocally - true to answer cost-only RoutePlanRequests with the visibility planner even when
+ *                      an ICAROUS planner is selected, keeping ICAROUS for routes that will be flown (default true)
+ *  - RacePlanners - Comma separated ICAROUS planners (e.g. "GRID,ASTAR,RRT") that each plan every leg at once,
+ *                      on different instances where there are enough; overrides RoutePlannerUsed (default none)
+ *  - RaceDeadline - Milliseconds a race waits for the shortest route; 0 takes the first route back (default 0)
+ *  - DeviationAllowed - Metres a vehicle may stray from its MissionCommand route before its tasks are
+ *                      paused with TaskPause, and resumed with TaskResume once back; 0 disables (default 0)
+ *  - HandoffResumeFraction - Fraction of DeviationAllowed a vehicle must come back within before its
+ *                      tasks are resumed, so that one hovering at the limit doesn't flap (default 0.8)
+ *  - HandoffDwell - Milliseconds a vehicle stays paused or resumed before it may switch back (default 2000)
+ *  - DeviationOrigin - What the deviation is measured from (default path)
+ *                      line - only the route segments that are part of a task, such as a line search
+ *                      path - every segment of the route
+ *  - WaypointWindow - Number of MissionCommand waypoints kept loaded in ICAROUS ahead of the vehicle;
+ *                      the rest are streamed as it progresses (default 10)
  * 
  * Subscribed Messages:
  *  - afrl::cmasi::MissionCommand
  *  - afrl::cmasi::KeepInZone
  *  - afrl::cmasi::KeepOutZone
+ *  - afrl::cmasi::RemoveZones
  *  - afrl::cmasi::AirVehicleState
  *  - afrl::cmasi::AirVehicleConfiguration
  *  - uxas::common::MessageGroup::IcarousPathPlanner
  *  - uxas::messages::route::RoutePlanRequest
+ *  - uxas::messages::uxnative::IncrementWaypoint
+ *  - afrl::cmasi::KeyValuePair
  * 
  * Sent Messages:
  *  - afrl::cmasi::MissionCommand
@@ -105,6 +234,7 @@ namespace service
  *  - uxas::messages::route::RoutePlanResponse
  *  - uxas::messages::task::TaskPause
  *  - uxas::messages::task::TaskResume
+ *  - afrl::cmasi::KeyValuePair
  *
  */
 
@@ -144,6 +274,15 @@ public:
 
     /** brief Listen to ICAROUS clients for commands*/
     void ICAROUS_listener(int id);
+    
+    /** brief Drain the outbound queue of one ICAROUS instance onto its socket*/
+    void ICAROUS_writer(int id);
+    
+    /** brief Connect, reconnect and check the liveness of every ICAROUS link*/
+    void ICAROUS_connectionManager();
+    
+    /** brief Finish ICAROUS replies and planner deadlines when no LMCP message arrives to do it*/
+    void ICAROUS_servicer();
 
     virtual
     ~IcarousCommunicationService();
@@ -182,16 +321,789 @@ private:
 
     bool
     processReceivedLmcpMessage(std::unique_ptr<uxas::communications::data::LmcpMessage> receivedLmcpMessage) override;
+    
+    //Handlers for received messages, looked up by LMCP series and type. Each handler is
+    //given ownership of the received object.
+    typedef void (IcarousCommunicationService::*messageHandler)(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    typedef struct lmcpTypeKey{
+        int64_t seriesID;
+        uint32_t typeID;
+        bool operator==(const lmcpTypeKey &other) const { return seriesID == other.seriesID && typeID == other.typeID; }
+    }lmcpTypeKey;
+    
+    typedef struct lmcpTypeKeyHash{
+        size_t operator()(const lmcpTypeKey &key) const { return std::hash<int64_t>()(key.seriesID) ^ (std::hash<uint32_t>()(key.typeID) * 0x9E3779B1u); }
+    }lmcpTypeKeyHash;
+    
+    std::unordered_map<lmcpTypeKey, messageHandler, lmcpTypeKeyHash> messageHandlers;
+    
+    void
+    registerMessageHandler(int64_t seriesID, uint32_t typeID, messageHandler handler);
+    
+    void
+    handleAirVehicleConfiguration(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    handleAirVehicleState(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    bool
+    ingestAirVehicleState(std::shared_ptr<afrl::cmasi::AirVehicleState> newState);
+    
+    void
+    runControlTick();
+    
+    //Local East-North-Up tangent plane anchored at the scenario origin; all control geometry is
+    //done in metres in this frame and converted back only to build outgoing locations
+    typedef struct enuPoint{
+        double east;
+        double north;
+        double up;
+    }enuPoint;
+    
+    void
+    setFrameOrigin(double latitude, double longitude);
+    
+    enuPoint
+    toENU(double latitude, double longitude, double altitude);
+    
+    void
+    fromENU(const enuPoint &point, double &latitude, double &longitude);
+    
+    void
+    setLocationFromENU(afrl::cmasi::Location3D *loc, const enuPoint &point);
+    
+    void
+    updateFleetFrame();
+    
+    bool isFrameOriginSet{false};
+    double originLatitude{0.};
+    double originLongitude{0.};
+    //Earth-centred coordinates of the origin and the frame's axes
+    std::array<double, 3> frameOriginECEF;
+    std::array<double, 3> frameEast;
+    std::array<double, 3> frameNorth;
+    std::array<double, 3> frameUp;
+    
+    //Position and velocity (m/s) of every vehicle at this tick's control time, and where it will
+    //be after one projection step
+    std::vector<enuPoint> fleetPositions;
+    std::vector<enuPoint> fleetVelocities;
+    std::vector<enuPoint> projectedPositions;
+    
+    //Recent states of each vehicle, so that vehicles reporting at different times can all be
+    //brought to one control time
+    static const int stateHistoryLength = 8;
+    typedef struct stateSample{
+        int64_t time;
+        enuPoint position;
+        double heading;
+        double u;
+        double v;
+    }stateSample;
+    
+    typedef struct stateHistory{
+        std::array<stateSample, stateHistoryLength> samples;
+        int newest;
+        int count;
+    }stateHistory;
+    
+    void
+    recordStateSample(int index, const std::shared_ptr<afrl::cmasi::AirVehicleState> &state);
+    
+    void
+    alignToControlTime(int index, int64_t controlTime, const enuPoint &newestVelocity, enuPoint &position);
+    
+    //Resolve body-axis speeds into east and north components for a whole fleet at once. Arrays
+    //are laid out per field so the loop vectorizes; headings are in degrees.
+    static void
+    resolveVelocities(const double *heading, const double *u, const double *v,
+                      double *east, double *north, int count);
+    
+    std::vector<stateHistory> stateHistories;
+    //Per-field scratch arrays for resolveVelocities, sized once in initialize()
+    std::vector<double> newestHeadings;
+    std::vector<double> newestU;
+    std::vector<double> newestV;
+    std::vector<double> velocityEast;
+    std::vector<double> velocityNorth;
+    int64_t controlTimeLag{0};
+    int64_t previousControlTime{-1};
+    //Seconds between this tick's control time and the last one's; the projection step
+    double projectionStep{0.5};
+    double projectionHorizon{5.};
+    
+    enuPoint
+    solveMonitorStandoff(int vehicleID, const std::vector<enuPoint> &targets,
+                         const std::vector<double> &distances, const enuPoint &reference);
+    
+    //Last standoff point found for each monitoring vehicle, used to warm start the next tick
+    std::vector<enuPoint> previousStandoff;
+    std::vector<bool> hasPreviousStandoff;
+    
+    //Uniform grid over vehicle positions in the local frame. Vehicles are only moved between
+    //buckets when they cross into a new cell, and a radius query only visits the cells the
+    //query circle overlaps, so lookups cost O(1) on average however large the fleet is.
+    class spatialGrid{
+    public:
+        explicit spatialGrid(double cellEdge = 500.) : cellSize(cellEdge) {}
+        
+        void reset(int numVehicles, double cellEdge);
+        void update(int vehicleID, const enuPoint &position);
+        void remove(int vehicleID);
+        void queryRadius(const enuPoint &center, double radius, std::vector<int> &foundIDs) const;
+        double getCellSize() const { return cellSize; }
+        
+    private:
+        int64_t cellKey(int64_t cellEast, int64_t cellNorth) const { return (int64_t)(((uint64_t)cellEast << 32) ^ ((uint64_t)cellNorth & 0xffffffffu)); }
+        int64_t cellOf(const enuPoint &position) const;
+        
+        double cellSize;
+        std::unordered_map<int64_t, std::vector<int>> cells;
+        std::vector<enuPoint> positions;
+        std::vector<int64_t> vehicleCell;
+        std::vector<bool> isIndexed;
+    };
+    
+    //Vehicles within radius metres of a point, from this tick's positions
+    void
+    findVehiclesWithin(const enuPoint &center, double radius, std::vector<int> &foundIDs);
+    
+    spatialGrid fleetIndex;
+    double spatialCellSize{500.};
+    
+    //Checks this tick's commands for loss of separation before they are sent
+    void
+    resolveConflicts();
+    
+    double separationDistance{0.};
+    double separationHorizon{10.};
+    bool isSeparationAdjusted{true};
+    spatialGrid loiterIndex;
+    uint64_t trajectoryConflictCount{0};
+    uint64_t loiterConflictCount{0};
+    
+    void
+    solveFormation();
+    
+    //The sparse least-squares system of the last formation solve: one column per vehicle in
+    //columnIDs, rows in compressed form, right hand sides for east and north
+    typedef struct formationSystem{
+        std::vector<int> columnIDs;
+        std::vector<int> rowStart;
+        std::vector<int> entryColumns;
+        std::vector<double> entryValues;
+        std::vector<double> rhsEast;
+        std::vector<double> rhsNorth;
+    }formationSystem;
+    formationSystem formationRows;
+    
+    void
+    emitLoiterCommands();
+    
+    //Loiter points decided during the current tick, sent together at the end of it. Any
+    //approach waypoints are flown in order before the loiter point.
+    typedef struct loiterCommand{
+        int vehicleID;
+        enuPoint location;
+        std::vector<enuPoint> approach;
+    }loiterCommand;
+    std::vector<loiterCommand> tickCommands;
+    
+    //Keep-in or keep-out boundary in the local frame. The polygon is cut into horizontal slabs
+    //at its vertices, and each slab holds the edges crossing it ordered west to east, so a
+    //containment test is two binary searches, O(log edges). The nearest-edge search used to move
+    //a point back across the boundary walks a tree of bounding boxes over runs of consecutive
+    //edges, nearer boxes first, so it visits O(log edges) of them for a point near the boundary.
+    class geofencePolygon{
+    public:
+        void build(const std::vector<enuPoint> &boundary);
+        bool contains(const enuPoint &point) const;
+        //Whether some part of the segment lies off the given side, the interior when isInside is
+        //set; running along or touching the boundary doesn't count
+        bool crossesSegment(const enuPoint &from, const enuPoint &to, bool isInside) const;
+        //Points margin metres off each vertex, outside the polygon when isOutside is set and inside otherwise
+        void offsetVertices(double margin, bool isOutside, std::vector<enuPoint> &offsets) const;
+        enuPoint stepAcross(const enuPoint &point, double margin) const;
+        bool isEmpty() const { return vertices.size() < 3; }
+        
+    private:
+        double eastAt(int edge, double north) const;
+        
+        typedef struct edgeBox{
+            double minEast;
+            double maxEast;
+            double minNorth;
+            double maxNorth;
+        }edgeBox;
+        
+        std::vector<enuPoint> vertices;
+        std::vector<edgeBox> edgeBoxes;
+        //node n covers nodes 2n and 2n + 1; leaves start at edgeTreeLeaves, padded with empty boxes
+        std::vector<edgeBox> edgeTree;
+        int edgeTreeLeaves{0};
+        edgeBox bounds;
+        std::vector<double> slabNorth;
+        std::vector<std::vector<int>> slabEdges;
+    };
+    
+    typedef struct geofenceZone{
+        int64_t zoneID;
+        bool isKeepIn;
+        double minAltitude;
+        double maxAltitude;
+        double padding;
+        int64_t startTime;
+        int64_t endTime;
+        std::vector<int64_t> affectedAircraft;
+        geofencePolygon polygon;
+        //ICAROUS GEOFN record, serialized once however many instances receive it
+        std::shared_ptr<const std::string> record;
+        uint64_t version;
+    }geofenceZone;
+    
+    void
+    handleKeepInZone(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    handleKeepOutZone(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    handleRemoveZones(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    storeZone(const std::shared_ptr<afrl::cmasi::AbstractZone> &zone, bool isKeepIn);
+    
+    std::string
+    formatGeofence(int64_t zoneID, bool isKeepIn, double floor, double roof, const std::vector<enuPoint> &vertices);
+    
+    //Sends each ICAROUS instance only the zones it doesn't hold at their current version, and
+    //removals for the ones it holds that are gone or no longer apply to it
+    void
+    syncGeofences();
+    
+    static bool
+    zoneAppliesTo(const geofenceZone &zone, int vehicleID);
+    
+    //Moves this tick's loiter and approach points into every keep-in zone and out of every
+    //keep-out zone that applies to the vehicle
+    void
+    enforceGeofences();
+    
+    bool
+    clampToGeofences(int vehicleID, enuPoint &point);
+    
+    std::map<int64_t, geofenceZone> geofenceZones;
+    //Guards changes to geofenceZones against the connection manager reading them for a resync;
+    //the service thread reads them without it
+    std::mutex geofenceMutex;
+    uint64_t geofenceVersion{0};
+    //Version of each zone as last queued to each ICAROUS instance; a record the queue refused
+    //is left out, and isGeofenceSyncPending has the next tick try again. A record evicted from
+    //the queue after all has its zone set back to version 0, which no zone ever has.
+    std::vector<std::map<int64_t, uint64_t>> sentZoneVersions;
+    bool isGeofenceSyncPending{false};
+    uint64_t geofenceRecordsSent{0};
+    
+    //Route planning bridge. Every leg of a RoutePlanRequest is sent to an ICAROUS planner as
+    //soon as the request arrives, tagged with a ticket, without waiting on earlier legs.
+    //Replies are parsed on the listener threads in whatever order they come and handed to the
+    //service thread, which owns all of the bookkeeping below and sends each RoutePlanResponse
+    //once every one of its legs is answered or has timed out.
+    typedef struct plannerReply{
+        int64_t ticket;
+        bool isSuccess;
+        std::vector<std::array<double, 3>> waypoints; //latitude, longitude, altitude
+    }plannerReply;
+    
+    //Legs are cached by their endpoints rounded to RouteCacheResolution, the planner and the
+    //zones they were planned around
+    typedef struct routeCacheKey{
+        std::array<int64_t, 6> endpoints; //start east, north, up then end east, north, up
+        int planner;
+        size_t zoneHash;
+        bool operator==(const routeCacheKey &other) const{
+            return endpoints == other.endpoints && planner == other.planner && zoneHash == other.zoneHash;
+        }
+    }routeCacheKey;
+    
+    struct routeCacheKeyHash{
+        size_t operator()(const routeCacheKey &key) const{
+            size_t seed = key.zoneHash ^ std::hash<int>()(key.planner);
+            for(int64_t value : key.endpoints){
+                seed ^= std::hash<int64_t>()(value) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+            }
+            return seed;
+        }
+    };
+    
+    typedef struct routeLeg{
+        int64_t planID;
+        int legIndex;
+        int instanceID;
+        int64_t sentMs;
+        routeCacheKey cacheKey;
+        int planner;
+        int64_t raceID; //-1 unless the leg is one of several planners racing
+    }routeLeg;
+    
+    //Several planners working on one leg. The shortest route back by RaceDeadline wins (or the
+    //first back, with no deadline) and the planners still working are told to stop.
+    typedef struct routeRace{
+        int64_t planID;
+        int legIndex;
+        routeCacheKey cacheKey;
+        std::vector<int64_t> tickets; //contenders still out
+        int64_t startedMs;
+        std::vector<std::array<double, 3>> bestWaypoints;
+        double bestLength;
+        int bestPlanner;
+        int64_t bestLatency;
+    }routeRace;
+    
+    typedef struct pendingRoutePlan{
+        std::shared_ptr<uxas::messages::route::RoutePlanRequest> request;
+        std::shared_ptr<uxas::messages::route::RoutePlanResponse> response;
+        int legsRemaining;
+    }pendingRoutePlan;
+    
+    void
+    handleRoutePlanRequest(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    int64_t
+    dispatchRouteLeg(int64_t planID, int legIndex, int instanceID, const routeCacheKey &cacheKey, int planner, int64_t raceID);
+    
+    //Uses the race's best route, or fails the leg if it has none, and cancels the rest
+    void
+    settleRace(int64_t raceID);
+    
+    double
+    routeLength(const std::vector<std::array<double, 3>> &waypoints);
+    
+    static bool
+    parsePlannerReply(const std::string &line, plannerReply &reply);
+    
+    //Applies replies handed over by the listeners and expires legs past PlannerTimeout
+    void
+    servicePlannerReplies();
+    
+    //reply is null when the leg timed out
+    void
+    completeRouteLeg(int64_t ticket, const plannerReply *reply);
+    
+    void
+    fillRouteLeg(pendingRoutePlan &pending, int legIndex, const std::vector<std::array<double, 3>> &waypoints);
+    
+    //Counts a leg as done, sending the response once it was the last
+    void
+    finishRouteLeg(int64_t planID);
+    
+    routeCacheKey
+    makeRouteCacheKey(uxas::messages::route::RouteConstraints *routeConstraints);
+    
+    //Moves a hit to the front of the recency list; returns null on a miss
+    const std::vector<std::array<double, 3>>*
+    findCachedRoute(const routeCacheKey &key);
+    
+    void
+    cacheRoute(const routeCacheKey &key, const std::vector<std::array<double, 3>> &waypoints);
+    
+    //Forgets every cached leg; called whenever the zones change
+    void
+    invalidateRouteCache();
+    
+    //Visibility planner. Nodes sit just off every zone vertex on the free side, and the pairs
+    //of nodes that can see each other are found once whenever the zones change; a query then
+    //only has to connect its two endpoints to the graph and run A*. Endpoints that see each
+    //other directly skip the graph altogether.
+    bool
+    planLocalRoute(const enuPoint &start, const enuPoint &end, std::vector<enuPoint> &path);
+    
+    void
+    buildVisibilityGraph();
+    
+    bool
+    isFreePoint(const enuPoint &point) const;
+    
+    bool
+    isSegmentClear(const enuPoint &from, const enuPoint &to) const;
+    
+    std::vector<enuPoint> visibilityNodes;
+    std::vector<std::vector<std::pair<int, double>>> visibilityEdges;
+    bool isVisibilityGraphStale{true};
+    bool isPlanningCostsLocally{true};
+    uint64_t routeLegsPlannedLocally{0};
+    
+    typedef std::pair<routeCacheKey, std::vector<std::array<double, 3>>> routeCacheEntry;
+    std::list<routeCacheEntry> routeCacheOrder;
+    std::unordered_map<routeCacheKey, std::list<routeCacheEntry>::iterator, routeCacheKeyHash> routeCache;
+    int routeCacheSize{1024};
+    double routeCacheResolution{10.};
+    size_t zoneHash{0};
+    uint64_t routeCacheHits{0};
+    uint64_t routeCacheMisses{0};
+    
+    int routePlannerUsed{0};
+    int64_t plannerTimeout{5000};
+    int64_t lastPlannerTimeoutCheck{0};
+    int64_t nextRouteTicket{1};
+    int64_t nextRoutePlanID{1};
+    int nextPlannerInstance{0};
+    std::unordered_map<int64_t, routeLeg> routeLegs;
+    std::unordered_map<int64_t, pendingRoutePlan> pendingRoutePlans;
+    std::mutex plannerReplyMutex;
+    std::vector<plannerReply> plannerReplies;
+    uint64_t routeLegsSent{0};
+    uint64_t routeLegsAnswered{0};
+    uint64_t routeLegsTimedOut{0};
+    uint64_t routeLegsRefused{0};
+    //MissionCommand translation. Waypoints are put in flight order once, then ICAROUS is only
+    //ever given WaypointWindow of them past the one the vehicle is flying to; each step of
+    //progress, from IncrementWaypoint or an ICAROUS WPRCH report, streams in the next ones.
+    //A push the outbound queue refuses is retried by the servicer; nothing after it is sent
+    //first, so ICAROUS always gets the plan in order.
+    typedef struct flightPlanStream{
+        std::shared_ptr<afrl::cmasi::MissionCommand> mission;
+        std::vector<afrl::cmasi::Waypoint*> ordered;
+        int nextToSend;
+        int current;
+        bool isStarted; //FPCLR, the first window and START_MISSION are queued, and none of it was evicted since
+    }flightPlanStream;
+    
+    void
+    handleMissionCommand(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    handleIncrementWaypoint(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    //Sends the waypoints now inside the window and records what ICAROUS holds for a resync
+    void
+    streamFlightPlan(int instanceID);
+    
+    bool
+    startFlightPlan(int instanceID);
+    
+    //Streams every plan that had a push refused
+    void
+    retryFlightPlans();
+    
+    void
+    advanceFlightPlan(int instanceID, int current);
+    
+    void
+    stopFlightPlan(int instanceID);
+    
+    //Applies waypoint progress handed over by the listeners
+    void
+    serviceFlightPlanProgress();
+    
+    std::string
+    formatFlightPlanWaypoint(const flightPlanStream &plan, int index);
+    
+    //Bounding volume hierarchy over the segments of a route in the local frame. The nearest
+    //segment to a point is found by descending into the closer box first and skipping any box
+    //farther away than the best segment so far, which visits O(log segments) nodes for the
+    //usual case of a vehicle near its route.
+    class segmentTree{
+    public:
+        void build(const std::vector<enuPoint> &starts, const std::vector<enuPoint> &ends, const std::vector<int> &ids);
+        double nearest(const enuPoint &point, int &id) const;
+        bool isEmpty() const { return nodes.empty(); }
+        void clear();
+        
+    private:
+        int buildRange(int first, int last);
+        
+        typedef struct node{
+            double minEast;
+            double maxEast;
+            double minNorth;
+            double maxNorth;
+            int left;
+            int right;
+            int segment; //leaves only, -1 otherwise
+        }node;
+        
+        std::vector<node> nodes;
+        std::vector<enuPoint> segmentStarts;
+        std::vector<enuPoint> segmentEnds;
+        std::vector<int> segmentIDs;
+        std::vector<int> order;
+    };
+    
+    void
+    buildDeviationIndex(int instanceID);
+    
+    //Cross-track check of one vehicle against its route, once per tick on its newest state
+    void
+    trackDeviation(int instanceID);
+    
+    enum deviationOrigins{lineDeviation, pathDeviation};
+    
+    std::vector<flightPlanStream> flightPlans;
+    bool isFlightPlanPushPending{false};
+    std::vector<segmentTree> routeIndexes;
+    double deviationAllowed{0.};
+    deviationOrigins deviationOrigin{pathDeviation};
+    
+    //Hand-off of each vehicle's tasks between UxAS and ICAROUS. A vehicle is held paused while
+    //it is off its route or ICAROUS has taken control of it; being off the route starts above
+    //DeviationAllowed but only ends below HandoffResumeFraction of it, and no vehicle switches
+    //again within HandoffDwell of its last switch. Switches are decided once per tick, so a
+    //pause and resume within one tick cancel out; only the decision is batched, as TaskPause
+    //and TaskResume name a single task and every task still gets a message of its own.
+    typedef struct handoffState{
+        bool isPaused;
+        bool isOffRoute;
+        bool isIcarousInControl;
+        int64_t lastSwitchTime;
+        std::vector<int64_t> pausedTasks;
+        std::vector<int64_t> tasksAtRisk; //what a pause now would cover
+    }handoffState;
+    
+    void
+    flushHandoffs(int64_t now);
+    
+    //Applies ICAROUS mode reports handed over by the listeners
+    void
+    serviceIcarousModes();
+    
+    std::vector<handoffState> handoffStates;
+    double handoffResumeFraction{0.8};
+    int64_t handoffDwell{2000};
+    std::mutex icarousModeMutex;
+    std::vector<std::pair<int, bool>> icarousModes; //instance, whether ICAROUS took control
+    uint64_t handoffPauses{0};
+    uint64_t handoffResumes{0};
+    int waypointWindow{10};
+    std::mutex waypointProgressMutex;
+    std::vector<std::pair<int, int>> waypointProgress; //instance, waypoint index reached
+    uint64_t flightPlanWaypointsSent{0};
+    
+    std::vector<int> racePlanners;
+    int64_t raceDeadline{0};
+    std::unordered_map<int64_t, routeRace> routeRaces;
+    //Earliest deadline of a race still running, steady ms; the servicer wakes for it
+    std::atomic<int64_t> nextRaceDeadline{std::numeric_limits<int64_t>::max()};
+    std::array<uint64_t, 4> raceWins{{0, 0, 0, 0}};
+    std::array<int64_t, 4> raceWinLatency{{0, 0, 0, 0}};
+    uint64_t racesLost{0};
+    uint64_t geofenceClampCount{0};
+    uint64_t geofenceViolationCount{0};
+    
+    //Receding-horizon controller. The idle vehicles plan mpcHorizon steps each toward their
+    //formation positions together, minimizing distance to them, the centroid and relative
+    //constraint residuals at every step, and step size, with every step no longer than the
+    //vehicle's nominal speed allows. The QP is solved with accelerated projected gradient,
+    //warm started from the previous tick's plan shifted by one step.
+    static const int mpcHorizon = 5;
+    typedef std::array<double, 2 * mpcHorizon> mpcPlan;
+    
+    enum formationControllers{reactiveController, predictiveController};
+    
+    void
+    planPredictiveApproach();
+    
+    void
+    solvePlanQP(const std::vector<enuPoint> &goals, const std::vector<double> &maxSteps, std::vector<mpcPlan> &plans);
+    
+    void
+    replanApproach(loiterCommand &command, const enuPoint &previousLocation);
+    
+    formationControllers formationController{reactiveController};
+    double predictiveStepTime{1.};
+    std::chrono::microseconds controllerBudget{1000};
+    std::vector<mpcPlan> previousPlans;
+    std::vector<bool> hasPreviousPlan;
+    
+    //Nominal speed of each vehicle from its AirVehicleConfiguration, 0 until one arrives
+    std::vector<double> nominalSpeeds;
 
 private:
     
+    //What to do with a new outbound message when an ICAROUS queue is full
+    enum overflowPolicies{dropOldest, coalesceLatest, blockProducer};
+    
+    //Bounded lock-free queue of messages waiting to be written to one ICAROUS instance.
+    //Any thread may push; the writer thread for the instance pops. Producers also pop
+    //when dropping the oldest message, so the cells are sequenced as a bounded MPMC ring.
+    class outboundQueue{
+    public:
+        explicit outboundQueue(size_t requestedCapacity);
+        ~outboundQueue();
+        
+        bool tryPush(std::string &message);
+        bool tryPop(std::string &message);
+        size_t depth() const;
+        size_t capacity() const { return mask + 1; }
+        
+        //Newest command parked here under the coalesceLatest policy
+        std::atomic<std::string *> latestCommand{nullptr};
+        
+        //Wakes the writer thread whenever something is queued
+        sem_t messagesWaiting;
+        
+        //Wakes producers waiting under the blockProducer policy whenever a slot frees up
+        sem_t spaceAvailable;
+        std::atomic<int> waitingProducers{0};
+        
+        //Metrics, readable from any thread
+        std::atomic<uint64_t> enqueuedCount{0};
+        std::atomic<uint64_t> sentCount{0};
+        std::atomic<uint64_t> droppedCount{0};
+        std::atomic<uint64_t> coalescedCount{0};
+        std::atomic<size_t> highWaterMark{0};
+        
+        //Records the dropOldest policy evicted that the service thread counts as delivered,
+        //handed back to it so they are sent again; guarded by lostMutex
+        std::mutex lostMutex;
+        std::vector<std::string> lostRecords;
+        std::atomic<bool> hasLostRecords{false};
+        
+    private:
+        typedef struct cell{
+            std::atomic<size_t> sequence;
+            std::string message;
+        }cell;
+        
+        cell *buffer;
+        size_t mask;
+        //keep the producer and consumer positions on separate cache lines
+        char padding0[64];
+        std::atomic<size_t> enqueuePos{0};
+        char padding1[64];
+        std::atomic<size_t> dequeuePos{0};
+    };
+    
+    //Snapshot of the metrics of one outbound queue
+    typedef struct outboundQueueMetrics{
+        size_t depth;
+        size_t highWaterMark;
+        uint64_t enqueued;
+        uint64_t sent;
+        uint64_t dropped;
+        uint64_t coalesced;
+    }outboundQueueMetrics;
+    
+    //Hand a message to the writer for an ICAROUS instance without blocking on its socket
+    //(unless the blockProducer policy is selected). isCommand marks messages that may be
+    //coalesced, since only the newest command to a vehicle matters.
+    bool
+    queueIcarousMessage(int instanceID, std::string message, bool isCommand);
+    
+    std::string
+    formatLoiterCommand(afrl::cmasi::Location3D *loc);
+    
+    outboundQueueMetrics
+    getOutboundQueueMetrics(int instanceID);
+    
+    void
+    printOutboundQueueMetrics();
+    
+    //Marks what the queues evicted as unsent, so the next sync or stream sends it again
+    void
+    recoverLostRecords();
+    
+    //Managed link to one ICAROUS instance. Only the connection manager opens sockets and
+    //publishes them in link; any thread that sees the link fail calls dropConnection with the
+    //link it used. The link pairs the descriptor with a generation that every new connection
+    //bumps, so a thread holding an old link can't close a new socket that reused its number.
+    enum connectionStates{disconnected, connecting, connected};
+    typedef struct icarousConnection{
+        std::atomic<uint64_t> link{0};
+        int pendingSockfd{-1};
+        connectionStates state{disconnected};
+        std::chrono::milliseconds backoff{0};
+        std::chrono::steady_clock::time_point nextAttempt;
+        std::chrono::steady_clock::time_point connectStarted;
+        std::chrono::steady_clock::time_point lastHeartbeat;
+        std::atomic<int64_t> lastHeardMs{0};
+        std::atomic<uint32_t> reconnectCount{0};
+        //Most recent command for the vehicle, replayed after a reconnect
+        std::shared_ptr<std::string> lastCommand;
+        //Flight plan waypoints ICAROUS should currently hold, likewise replayed
+        std::shared_ptr<std::string> flightPlanWindow;
+    }icarousConnection;
+    
+    void
+    startConnect(int instanceID);
+    
+    void
+    finishConnect(int instanceID);
+    
+    void
+    scheduleReconnect(int instanceID);
+    
+    void
+    dropConnection(int instanceID, uint64_t link);
+    
+    //Descriptor of a link, or -1 if it has none
+    static int
+    linkSocket(uint64_t link){ return (int)(link & 0xffffffff) - 1; }
+    
+    //Everything an ICAROUS needs to resume after a restart, as a single buffer
+    std::string
+    buildResyncBurst(int instanceID);
+    
+    bool
+    sendAll(int sockfd, const std::string &buffer);
+    
+    int64_t
+    steadyMilliseconds();
+    
+    //One connection, outbound queue, writer and listener per ICAROUS instance
+    std::vector<std::unique_ptr<icarousConnection>> connections;
+    std::vector<std::unique_ptr<outboundQueue>> outboundQueues;
+    std::vector<std::thread> writerThreads;
+    std::vector<std::thread> listenerThreads;
+    std::thread connectionManagerThread;
+    std::atomic<bool> isTerminating{false};
+    
+    //Work the listeners hand over (planner replies, waypoint progress, mode changes) and the
+    //planner deadlines are finished by whichever of the service thread and the servicer gets to
+    //them first; both hold serviceMutex throughout, so the service state still only ever has
+    //one thread in it. A listener wakes the servicer as soon as it hands something over.
+    void
+    serviceIcarousReplies();
+    
+    void
+    wakeServicer();
+    
+    std::thread servicerThread;
+    std::mutex serviceMutex;
+    std::mutex servicerMutex;
+    std::condition_variable servicerSignal;
+    bool hasRepliesWaiting{false}; //guarded by servicerMutex
+    std::chrono::milliseconds servicePeriod{50};
+    size_t outboundQueueCapacity{64};
+    overflowPolicies outboundOverflowPolicy{dropOldest};
+    std::string icarousHost{"127.0.0.1"};
+    std::chrono::milliseconds reconnectBackoffMin{100};
+    std::chrono::milliseconds reconnectBackoffMax{10000};
+    std::chrono::milliseconds heartbeatPeriod{1000};
+    std::chrono::milliseconds livenessTimeout{5000};
+    
     //Whether or not a UAV has updated in this timestep
     std::vector<bool> hasUpdated;
+    int numUpdatedThisTick{0};
+    
+    //States per UAV that were superseded before a tick could use them, or arrived out of order
+    std::vector<uint64_t> droppedStateUpdates;
     
     // Number of unique controlled UAVs in the scenario
     int32_t NUM_UAVS{3};
     // Number of UAVs that are being monitored but aren't controlled
     int32_t NUM_MONITOR{1};
+    // Number of UAVs that must update before a tick; resolved against the fleet size in initialize()
+    int32_t tickQuorum{0};
+    
+    enum traceLevels{traceQuiet, traceEvents, traceMessages};
+    int traceLevel{traceEvents};
+    
+    //Sizes allocated up front so that nothing grows while running
+    int flightPlanCapacity{256};
+    int routePlanCapacity{64};
+    int assignmentTrials{0};
     
     // Holds state information for all vehicles
     std::vector<std::shared_ptr<afrl::cmasi::AirVehicleState>> vehicleStates;
@@ -219,13 +1131,31 @@ private:
         constraint *data;
         std::vector<struct constraintNode *> parents;
         std::vector<struct constraintNode *> children;
+        bool isNew{false}; //added since the graph was last closed under the rules
+        bool isTask{false}; //assigned directly rather than inferred
     }constraintNode;
     
     bool
     checkCompatibility(std::vector<constraintNode *> constraintGraph);
     
+    //Working state of one closure. Each thread that closes graphs has its own, so the reload
+    //thread and the service thread never wait on each other.
+    typedef struct inferenceScratch{
+        std::vector<std::vector<constraintNode *>> nodeCombosThisIteration;
+        std::vector<inferenceRule> rulesAppliedThisIteration;
+        //When set, rules only fire on combinations that include a node marked isNew; the new
+        //nodes are those from inferenceFrontier on
+        bool isInferringIncrementally{false};
+        size_t inferenceFrontier{0};
+    }inferenceScratch;
+    
+    //Closes constraintGraph under rules in place, returning false on a conflict
+    bool
+    inferConstraints(std::vector<constraintNode *> &constraintGraph, const std::vector<inferenceRule> &rules,
+                     inferenceScratch &scratch);
+    
     bool
-    ruleApplies(inferenceRule *ruleToCheck, std::vector<constraintNode *> constraintGraph);
+    ruleApplies(inferenceRule *ruleToCheck, std::vector<constraintNode *> constraintGraph, inferenceScratch &scratch);
     
     bool 
     vectorContainsOnlyConstraintTypes(constraintTypes hay, std::vector<constraintTypes> haystack);
@@ -249,19 +1179,100 @@ private:
     
     bool nodeCombosEqual(std::vector<constraintNode *> comboToAdd, std::vector<constraintNode *> otherCombo);
     
-    std::vector<std::vector<constraintNode *>> nodeCombosThisIteration;
-    std::vector<inferenceRule> rulesAppliedThisIteration;
+    inferenceScratch serviceInference; //service thread only
+    //Rule library built into the service, published as the first library in start()
     std::vector<inferenceRule> ruleList;
     
-    std::vector<int> monitoringIDs;
-    std::vector<int> idleIDs;
-    std::vector<int> vehicleIDs;
     bool monitoringTaskActiveGlobal{false};
-    
-    //Holds constraint groups for UAVs
-    std::vector<constraint> constraints;
     bool constraintsInitialized{false};
     
+    //Constraints are replaced read-copy-update style. A reload parses and checks a whole new set
+    //on the reload thread and stages it; the service thread adopts the staged set between ticks
+    //and publishes it for the other threads, which only ever take a snapshot of it. The control
+    //loop reads the adopted set in place through activeConstraints, so adopting copies nothing.
+    typedef struct constraintSet{
+        std::vector<constraint> constraints;
+        std::vector<int> monitoringIDs;
+        std::vector<int> idleIDs;
+        std::vector<int> vehicleIDs;
+        uint64_t version;
+    }constraintSet;
+    
+    void
+    handleKeyValuePair(std::shared_ptr<avtas::lmcp::Object> receivedObject);
+    
+    void
+    constraintReloader();
+    
+    //Parses rules and constraints, checks them against each other and stages the result
+    bool
+    compileConstraints(const std::string &text, const std::string &source);
+    
+    static bool
+    parseConstraintType(const std::string &name, constraintTypes &type);
+    
+    //Reads one constraint of the given kind, returning what is wrong with it, if anything
+    std::string
+    parseConstraint(const std::string &kind, std::istream &tokens, int numVehicles, constraint &parsed);
+    
+    void
+    deriveConstraintIDs(constraintSet &set);
+    
+    void
+    adoptStagedConstraints();
+    
+    void
+    adoptConstraintSet(const std::shared_ptr<const constraintSet> &set);
+    
+    //The rule library is replaced the same way. A reload compiles and checks new rules on its own
+    //copy and publishes them whole once they pass; whoever closes a graph takes a snapshot.
+    std::shared_ptr<const std::vector<inferenceRule>> publishedRules{std::make_shared<const std::vector<inferenceRule>>()};
+    std::shared_ptr<const constraintSet> activeConstraints; //service thread only
+    std::shared_ptr<const constraintSet> publishedConstraints;
+    std::shared_ptr<const constraintSet> stagedConstraints;
+    std::thread reloadThread;
+    std::mutex reloadMutex;
+    std::condition_variable reloadSignal;
+    std::string pendingReloadText; //newest KeyValuePair text, guarded by reloadMutex
+    bool hasPendingReload{false};
+    std::string constraintFile;
+    std::chrono::milliseconds constraintReloadPeriod{1000};
+    std::atomic<uint64_t> constraintVersion{0};
+    std::atomic<uint64_t> reloadsRejected{0};
+    uint64_t reloadsAdopted{0};
+    
+    //Online task assignment. assignmentGraph holds the assigned tasks together with everything the
+    //rules infer from them, so admitting one more task only derives what involves the new task.
+    //A task that conflicts is rolled back out of the graph, and while the assigned tasks conflict with
+    //each other under the rules in force, no task is admitted until one is cancelled.
+    void
+    admitTask(const std::string &description);
+    
+    void
+    cancelTask(const std::string &description);
+    
+    void
+    rebuildAssignmentGraph();
+    
+    void
+    clearAssignmentGraph();
+    
+    //Makes the assigned tasks, and the relative constraints inferred from them, the live constraints
+    void
+    applyAssignment();
+    
+    void
+    reportTask(const std::string &status, const std::string &description);
+    
+    std::vector<constraint> assignedTasks;
+    std::vector<constraintNode *> assignmentGraph;
+    bool isAssignmentGraphStale{false};
+    std::shared_ptr<const std::vector<inferenceRule>> assignmentRules; //library the graph was last closed under
+    bool isAssignmentGraphClosed{true}; //false while the assigned tasks conflict under those rules
+    uint64_t tasksAdmitted{0};
+    uint64_t tasksRejected{0};
+    double admissionMs{0.};
+    
     std::vector<int> adjustedIDs;
 };
 